@@ -7,6 +7,13 @@
 #include <stdlib.h>
 #include <stdio.h>
 
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#define DICT_HAVE_MMAP 1
+#endif
+
 #include "DictObject.h"
 
 
@@ -44,6 +51,19 @@ meaning otherwise.
 */
 #define Dict_MINSIZE 8
 
+/* Tables of at least Dict_MMAP_THRESHOLD bytes are mmap'ed directly (backed
+* by huge pages when the system has them) instead of coming from malloc.
+* Random probes into a multi-GB table otherwise miss the TLB on nearly every
+* lookup.  The mapped length is rounded up to Dict_HUGEPAGE_SIZE, which is
+* what MAP_HUGETLB requires.
+*/
+#ifndef Dict_HUGEPAGE_SIZE
+#define Dict_HUGEPAGE_SIZE ((size_t)2 << 20)
+#endif
+#ifndef Dict_MMAP_THRESHOLD
+#define Dict_MMAP_THRESHOLD Dict_HUGEPAGE_SIZE
+#endif
+
 typedef struct {
 	/* Cached hash code of me_key.  Note that hash codes are C longs.
 	* We have to use Py_ssize_t instead because dict_popitem() abuses
@@ -54,6 +74,16 @@ typedef struct {
 	void *me_value;
 } DictEntry;
 
+/*
+One slot of the optional front cache, see Dict_EnableFrontCache().  fc_entry
+is the table entry that held the Active key fc_key when it was cached;
+fc_key == NULL marks an empty slot.
+*/
+typedef struct {
+	void *fc_key;
+	DictEntry *fc_entry;
+} DictCacheEntry;
+
 /*
 To ensure the lookup algorithm terminates, there must be at least one Unused
 slot (NULL key) in the table.
@@ -82,6 +112,25 @@ struct DictObject {
 	DictEntry *(*ma_lookup)(DictObject *mp, void *key, long hash);
 	long(*ma_hash)(void*);
 
+	/* Length of the mmap'ed region holding ma_table, or 0 if ma_table is
+	* ma_smalltable or malloc'ed.
+	*/
+	size_t ma_mapped;
+
+	/* NUMA placement applied to mmap'ed tables, see Dict_SetNumaPolicy(). */
+	int ma_numa_mode;
+	unsigned long ma_numa_nodemask;
+
+	/* Direct-mapped cache of recently found entries, indexed by the key
+	* pointer so that a hit skips both ma_hash and ma_lookup.  NULL when
+	* disabled.  It holds pointers into ma_table, so it is flushed whenever
+	* entries move or go away.
+	*/
+	DictCacheEntry *ma_fcache;
+	size_t ma_fcache_mask;
+	unsigned long ma_fcache_hits;
+	unsigned long ma_fcache_misses;
+
 	/* for debug */
 #ifdef DICT_OBJ_DEBUG
 	DictObjNode *ma_node;
@@ -128,10 +177,45 @@ static void *dummy = (void*) ("<dummy key>");
 #define EMPTY_TO_MINSIZE(mp) do {                                       \
     memset((mp)->ma_smalltable, 0, sizeof((mp)->ma_smalltable));        \
     (mp)->ma_used = (mp)->ma_fill = 0;                                  \
+    (mp)->ma_mapped = 0;                                                \
     INIT_NONZERO_DICT_SLOTS(mp);                                        \
     } while(0)
 
+/* Resize rule applied after a new key was added; see Dict_SetItem().
+   The Robin Hood engine keeps probe lengths short up to 90% load.  Its
+   rule counts one more key than is there, so that even a table whose grow
+   failed keeps an Unused slot for the next insertion (8 slots: grow at 7).
+   Growing it 2x after the 90% trigger lands at about 45% load; the 4x of
+   the default engine would throw that density away. */
+#define DICT_NEEDS_RESIZE(mp) (DICT_IS_ROBINHOOD(mp) ?                  \
+    ((mp)->ma_fill+1)*10 > ((mp)->ma_mask+1)*9 :                        \
+    (mp)->ma_fill*3 >= ((mp)->ma_mask+1)*2)
+#define DICT_GROW(mp) \
+    (dictresize((mp), (DICT_IS_ROBINHOOD(mp) || (mp)->ma_used > 50000 ? \
+                       2 : 4) * (mp)->ma_used))
+
+static int dictresize(DictObject *mp, ssize_t minused);
 static DictEntry* lookdict(DictObject *mp, void *key, register long hash);
+static DictEntry* lookdict_robinhood(DictObject *mp, void *key,
+                                     register long hash);
+
+#define DICT_IS_ROBINHOOD(mp) ((mp)->ma_lookup == lookdict_robinhood)
+
+/* Probe distance of the Active entry at index i from its home slot. */
+#define DICT_RH_DIST(ep, i, mask) (((i) - (size_t)(ep)->me_hash) & (mask))
+
+/* Front cache slot for `key`.  Keys are compared by identity, so the key
+   pointer itself is hashed (Fibonacci hashing, which also spreads the
+   small consecutive integers int_hash is used with). */
+#define DICT_FCACHE_SLOT(mp, key) \
+    (&(mp)->ma_fcache[((size_t)(key) * (size_t)0x9E3779B97F4A7C15ULL \
+                       >> (sizeof(size_t) * 4)) & (mp)->ma_fcache_mask])
+
+#define DICT_FCACHE_FLUSH(mp) do {                                      \
+    if ((mp)->ma_fcache != NULL)                                        \
+        memset((mp)->ma_fcache, 0,                                      \
+               sizeof(DictCacheEntry) * ((mp)->ma_fcache_mask + 1));    \
+    } while(0)
 
 #ifdef DICT_OBJ_DEBUG
 DictObject*
@@ -145,6 +229,11 @@ _DictDebug_New(long(*hash)(void*),
     EMPTY_TO_MINSIZE(mp);
     mp->ma_lookup = lookdict;
     mp->ma_hash = hash;
+    mp->ma_numa_mode = DICT_NUMA_DEFAULT;
+    mp->ma_numa_nodemask = 0;
+    mp->ma_fcache = NULL;
+    mp->ma_fcache_mask = 0;
+    mp->ma_fcache_hits = mp->ma_fcache_misses = 0;
     /* 将创建的DictObject对象插入obj_list中 */
     DictObjNode* np = (DictObjNode*) malloc(sizeof(DictObjNode));
     assert(np != NULL);
@@ -176,6 +265,11 @@ _Dict_New(long(*hash)(void*))
     EMPTY_TO_MINSIZE(mp);
     mp->ma_lookup = lookdict;
     mp->ma_hash = hash;
+    mp->ma_numa_mode = DICT_NUMA_DEFAULT;
+    mp->ma_numa_nodemask = 0;
+    mp->ma_fcache = NULL;
+    mp->ma_fcache_mask = 0;
+    mp->ma_fcache_hits = mp->ma_fcache_misses = 0;
     return mp;
 }
 
@@ -243,6 +337,138 @@ lookdict(DictObject *mp, void *key, register long hash)
     return 0;
 }
 
+/* Front cache probe used by the getitem functions.  Counts hits and misses
+   so that callers can tell whether the cache pays off for their workload. */
+static DictEntry *
+dict_fcache_find(DictObject *mp, void *key)
+{
+    DictCacheEntry *ce = DICT_FCACHE_SLOT(mp, key);
+    /* The Robin Hood engine moves entries around on insert and delete,
+       so make sure the entry still holds the key. */
+    if (ce->fc_key == key && ce->fc_entry->me_key == key) {
+        mp->ma_fcache_hits++;
+        return ce->fc_entry;
+    }
+    mp->ma_fcache_misses++;
+    return NULL;
+}
+
+/* Remember the entry ma_lookup found for `key`, if the key is present. */
+static void
+dict_fcache_store(DictObject *mp, void *key, DictEntry *ep)
+{
+    DictCacheEntry *ce;
+    if (ep->me_value == NULL)
+        return;
+    ce = DICT_FCACHE_SLOT(mp, key);
+    ce->fc_key = key;
+    ce->fc_entry = ep;
+}
+
+/*
+Alternative engine: Robin Hood hashing with linear probing, selected with
+Dict_SetEngine().  Entries along a probe sequence are kept ordered by their
+distance from their home slot (hash & mask), which is derived from the
+cached me_hash rather than stored separately.  Hence a failing search can
+stop at the first entry that is closer to home than the key would be, and a
+deletion shifts the following entries one slot back instead of leaving a
+dummy behind.  The table never contains Dummy slots, so ma_fill == ma_used.
+
+On a miss, lookdict_robinhood() returns rh_miss_entry, an Unused entry that
+is never written, and the new key has to go through insertdict_at(), which
+walks the probe sequence again and shifts the poorer entries along.  The
+lookup itself writes nothing, so reads may run between the two (e.g. from
+the callback of Dict_Upsert()).
+*/
+static DictEntry rh_miss_entry;
+
+static DictEntry *
+lookdict_robinhood(DictObject *mp, void *key, register long hash)
+{
+    register size_t i;
+    register size_t dist;
+    register size_t mask = (size_t)mp->ma_mask;
+    DictEntry *ep0 = mp->ma_table;
+    register DictEntry *ep;
+
+    i = (size_t)hash & mask;
+    for (dist = 0; ; dist++) {
+        ep = &ep0[i];
+        if (ep->me_key == NULL || DICT_RH_DIST(ep, i, mask) < dist)
+            break;
+        if (ep->me_key == key)
+            return ep;
+        i = (i + 1) & mask;
+    }
+    return &rh_miss_entry;
+}
+
+/*
+Insert a key known to be absent.  Starting from its home slot, whenever the
+entry in the way is closer to its home slot than the one being placed, the
+two are swapped and the displaced entry continues the walk.  Returns the
+entry the new key ended up in.
+*/
+static DictEntry *
+insertdict_robinhood(register DictObject *mp, void *key, long hash,
+                     void *value)
+{
+    register size_t i;
+    register size_t mask = (size_t)mp->ma_mask;
+    DictEntry *ep0 = mp->ma_table;
+    register DictEntry *ep;
+    DictEntry *placed = NULL;
+    DictEntry cur, tmp;
+
+    cur.me_hash = (ssize_t)hash;
+    cur.me_key = key;
+    cur.me_value = value;
+    i = (size_t)hash & mask;
+    for (;;) {
+        ep = &ep0[i];
+        if (ep->me_key == NULL) {
+            *ep = cur;
+            break;
+        }
+        if (DICT_RH_DIST(ep, i, mask) < DICT_RH_DIST(&cur, i, mask)) {
+            tmp = *ep;
+            *ep = cur;
+            cur = tmp;
+            /* The first entry written is the new key. */
+            if (placed == NULL)
+                placed = ep;
+        }
+        i = (i + 1) & mask;
+    }
+    mp->ma_fill++;
+    mp->ma_used++;
+    return placed != NULL ? placed : ep;
+}
+
+/* Backward-shift deletion: pull the rest of the cluster one slot closer to
+   home until an Unused entry or an entry already at home is reached. */
+static void
+deldict_robinhood(register DictObject *mp, DictEntry *ep)
+{
+    register size_t i, j;
+    register size_t mask = (size_t)mp->ma_mask;
+    DictEntry *ep0 = mp->ma_table;
+
+    i = (size_t)(ep - ep0);
+    for (;;) {
+        j = (i + 1) & mask;
+        if (ep0[j].me_key == NULL || DICT_RH_DIST(&ep0[j], j, mask) == 0)
+            break;
+        ep0[i] = ep0[j];
+        i = j;
+    }
+    ep0[i].me_hash = 0;
+    ep0[i].me_key = NULL;
+    ep0[i].me_value = NULL;
+    mp->ma_fill--;
+    mp->ma_used--;
+}
+
 /* Note that, for historical reasons, PyDict_GetItem() suppresses all errors
  * that may occur (originally dicts supported only string keys, and exceptions
  * weren't possible).  So, while the original intent was that a NULL return
@@ -259,6 +485,10 @@ Dict_GetItem(DictObject *mp, void *key)
     long hash;
     DictEntry *ep;
     assert(mp->ma_hash);
+    /* fc_key == NULL marks an empty cache slot, so NULL keys bypass it. */
+    if (mp->ma_fcache != NULL && key != NULL &&
+        (ep = dict_fcache_find(mp, key)) != NULL)
+        return ep->me_value;
     hash = (mp->ma_hash)(key);
     if (hash == -1) {
         return NULL;
@@ -267,9 +497,58 @@ Dict_GetItem(DictObject *mp, void *key)
     if (ep == NULL) {
         return NULL;
     }
+    if (mp->ma_fcache != NULL)
+        dict_fcache_store(mp, key, ep);
     return ep->me_value;
 }
 
+/* Same as Dict_GetItem(), for callers that already computed
+ * hash == mp->ma_hash(key).  Passing any other hash gives a wrong answer.
+ */
+void *
+Dict_GetItemKnownHash(DictObject *mp, void *key, long hash)
+{
+    DictEntry *ep;
+    assert(hash != -1);
+    /* fc_key == NULL marks an empty cache slot, so NULL keys bypass it. */
+    if (mp->ma_fcache != NULL && key != NULL &&
+        (ep = dict_fcache_find(mp, key)) != NULL)
+        return ep->me_value;
+    ep = (mp->ma_lookup)(mp, key, hash);
+    if (ep == NULL) {
+        return NULL;
+    }
+    if (mp->ma_fcache != NULL)
+        dict_fcache_store(mp, key, ep);
+    return ep->me_value;
+}
+
+/*
+Internal routine to fill the Unused or Dummy slot `ep` that ma_lookup
+returned for `key`.  Returns the entry now holding the key, which differs
+from `ep` for the Robin Hood engine.  The caller is responsible for the
+resize check.
+*/
+static DictEntry *
+insertdict_at(register DictObject *mp, register DictEntry *ep,
+              void *key, long hash, void *value)
+{
+    assert(ep->me_value == NULL);
+    if (ep == &rh_miss_entry)
+        return insertdict_robinhood(mp, key, hash, value);
+    if (ep->me_key == NULL) {
+        /* hash表里一个新的Entry被占用 */
+        mp->ma_fill++;
+    } else {
+        assert(ep->me_key == dummy);
+    }
+    ep->me_key = key;
+    ep->me_hash = hash;
+    ep->me_value = value;
+    mp->ma_used++;
+    return ep;
+}
+
 /*
 Internal routine to insert a new item into the table.
 Used both by the internal resize routine and by the public insert routine.
@@ -279,7 +558,6 @@ Returns -1 if an error occurred, or 0 on success.
 static int
 insertdict(register DictObject *mp, void *key, long hash, void *value)
 {
-    void* old_value;
     register DictEntry *ep;
     assert(mp->ma_lookup != NULL);
     ep = mp->ma_lookup(mp, key, hash);
@@ -289,16 +567,7 @@ insertdict(register DictObject *mp, void *key, long hash, void *value)
     if (ep->me_value != NULL) {
         ep->me_value = value;
     } else {
-        if (ep->me_key == NULL) {
-            /* hash表里一个新的Entry被占用 */
-            mp->ma_fill++;
-        } else {
-            assert(ep->me_key == dummy);
-        }
-        ep->me_key = key;
-        ep->me_hash = hash;
-        ep->me_value = value;
-        mp->ma_used++;
+        insertdict_at(mp, ep, key, hash, value);
     }
     return 0;
 }
@@ -320,6 +589,10 @@ insertdict_clean(register DictObject *mp, void *key, long hash,
     register size_t mask = (size_t)mp->ma_mask;
     DictEntry *ep0 = mp->ma_table;
     register DictEntry *ep;
+    if (DICT_IS_ROBINHOOD(mp)) {
+        insertdict_robinhood(mp, key, hash, value);
+        return;
+    }
     i = hash & mask;
     ep = &ep0[i];
     for (perturb = hash; ep->me_key != NULL; perturb >>= PERTURB_SHIFT) {
@@ -334,6 +607,96 @@ insertdict_clean(register DictObject *mp, void *key, long hash,
     mp->ma_used++;
 }
 
+#ifdef DICT_HAVE_MMAP
+/* Values of MPOL_BIND and MPOL_INTERLEAVE in <linux/mempolicy.h>; spelled
+   out so that we don't depend on libnuma. */
+#define DICT_MPOL_BIND       2
+#define DICT_MPOL_INTERLEAVE 3
+
+static DictEntry *
+dict_table_mmap(DictObject *mp, size_t len)
+{
+    void *p;
+
+#if defined(MAP_HUGETLB) && defined(MAP_HUGE_SHIFT)
+    /* Ask for Dict_HUGEPAGE_SIZE pages explicitly: with the bare flag the
+       kernel uses the default huge page size (possibly 1GB), and len would
+       no longer be a multiple of the page size for munmap(). */
+    int shift = 0;
+    while (((size_t)1 << shift) < Dict_HUGEPAGE_SIZE)
+        shift++;
+    p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+             (shift << MAP_HUGE_SHIFT), -1, 0);
+    if (p == MAP_FAILED)
+#endif
+    {
+        /* No reserved huge pages, fall back to transparent huge pages. */
+        p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            return NULL;
+#ifdef MADV_HUGEPAGE
+        madvise(p, len, MADV_HUGEPAGE);
+#endif
+    }
+#ifdef SYS_mbind
+    /* Pages are not faulted in yet, so the policy covers all of them.
+       Failure only costs locality, hence it is ignored. */
+    if (mp->ma_numa_mode != DICT_NUMA_DEFAULT) {
+        unsigned long nodemask = mp->ma_numa_nodemask;
+        syscall(SYS_mbind, p, len,
+                mp->ma_numa_mode == DICT_NUMA_BIND ?
+                    DICT_MPOL_BIND : DICT_MPOL_INTERLEAVE,
+                &nodemask, sizeof(nodemask) * 8 + 1, 0);
+    }
+#endif
+    return (DictEntry*) p;
+}
+#endif
+
+/*
+Allocate room for a table of `size` entries.  Large tables are mmap'ed and
+*pmapped receives the mapped length; such tables are already zeroed.
+Otherwise *pmapped is set to 0 and the table is left uninitialized.
+*/
+static DictEntry *
+dict_table_alloc(DictObject *mp, ssize_t size, size_t *pmapped)
+{
+    size_t nbytes = sizeof(DictEntry) * (size_t)size;
+
+    *pmapped = 0;
+#ifdef DICT_HAVE_MMAP
+    if (nbytes >= Dict_MMAP_THRESHOLD) {
+        size_t len;
+        DictEntry *table;
+        len = (nbytes + Dict_HUGEPAGE_SIZE - 1) & ~(Dict_HUGEPAGE_SIZE - 1);
+        table = dict_table_mmap(mp, len);
+        if (table != NULL) {
+            *pmapped = len;
+            return table;
+        }
+    }
+#endif
+    return (DictEntry*) malloc(nbytes);
+}
+
+static void
+dict_table_free(DictEntry *table, size_t mapped)
+{
+#ifdef DICT_HAVE_MMAP
+    if (mapped != 0) {
+        if (munmap(table, mapped) != 0) {
+            fprintf(stderr, "munmap of dict table failed");
+            assert(0);
+        }
+        return;
+    }
+#endif
+    assert(mapped == 0);
+    free(table);
+}
+
 /*
 Restructure the table by allocating a new table and reinserting all
 items again.  When entries have been deleted, the new table may
@@ -346,6 +709,7 @@ dictresize(DictObject *mp, ssize_t minused)
     DictEntry *oldtable, *newtable, *ep;
     ssize_t i;
     int is_oldtable_malloced;
+    size_t oldmapped, newmapped;
     DictEntry small_copy[Dict_MINSIZE];
     assert(minused >= 0);
 
@@ -360,6 +724,8 @@ dictresize(DictObject *mp, ssize_t minused)
     oldtable = mp->ma_table;
     assert(oldtable != NULL);
     is_oldtable_malloced = oldtable != mp->ma_smalltable;
+    oldmapped = mp->ma_mapped;
+    newmapped = 0;
 
     if (newsize == Dict_MINSIZE) {
         /* A large table is shrinking, or we can't get any smaller. */
@@ -381,7 +747,7 @@ dictresize(DictObject *mp, ssize_t minused)
         }
     }
     else {
-        newtable = (DictEntry*) malloc(sizeof(DictEntry) * newsize);
+        newtable = dict_table_alloc(mp, newsize, &newmapped);
         if (newtable == NULL) {
             fprintf(stderr, "no enough memory");
             return -1;
@@ -392,7 +758,11 @@ dictresize(DictObject *mp, ssize_t minused)
     assert(newtable != oldtable);
     mp->ma_table = newtable;
     mp->ma_mask = newsize - 1;
-    memset(newtable, 0, sizeof(DictEntry) * newsize);
+    mp->ma_mapped = newmapped;
+    DICT_FCACHE_FLUSH(mp);
+    /* A fresh mapping is already zeroed; don't fault every page in here. */
+    if (newmapped == 0)
+        memset(newtable, 0, sizeof(DictEntry) * newsize);
     mp->ma_used = 0;
     i = mp->ma_fill;
     mp->ma_fill = 0;
@@ -412,7 +782,7 @@ dictresize(DictObject *mp, ssize_t minused)
         /* else key == value == NULL:  nothing to do */
     }
     if (is_oldtable_malloced)
-        free(oldtable);
+        dict_table_free(oldtable, oldmapped);
     return 0;
 }
 
@@ -426,14 +796,26 @@ int
 Dict_SetItem(register DictObject *op, void *key, void *value)
 {
     register long hash;
-    register ssize_t n_used;
-    assert(key);
-    assert(value);
     assert(op->ma_hash);
 
     hash = op->ma_hash(key);
     if (hash == -1)
         return -1;
+    return Dict_SetItemKnownHash(op, key, hash, value);
+}
+
+/* Same as Dict_SetItem(), for callers that already computed
+ * hash == op->ma_hash(key).
+ */
+int
+Dict_SetItemKnownHash(register DictObject *op, void *key, long hash,
+                      void *value)
+{
+    register ssize_t n_used;
+    assert(key);
+    assert(value);
+    assert(hash != -1);
+
     assert(op->ma_fill <= op->ma_mask);  /* at least one empty slot */
     n_used = op->ma_used;
     if (insertdict(op, key, hash, value) == -1)
@@ -453,9 +835,109 @@ Dict_SetItem(register DictObject *op, void *key, void *value)
      * Very large dictionaries (over 50K items) use doubling instead.
      * This may help applications with severe memory constraints.
      */
-    if (!(op->ma_used > n_used && op->ma_fill*3 >= (op->ma_mask+1)*2))
+    if (!(op->ma_used > n_used && DICT_NEEDS_RESIZE(op)))
         return 0;
-    return dictresize(op, (op->ma_used > 50000 ? 2 : 4) * op->ma_used);
+    return DICT_GROW(op);
+}
+
+/*
+ * Look `key` up once and return in *pslot the address of its value slot.
+ * If the key is absent it is inserted with value `dflt` (which must not be
+ * NULL) and *pinserted is set to 1, else *pinserted is set to 0.  The usual
+ * Dict_SetItem() resize rule is applied after an insertion, so *pslot always
+ * points into the current table.
+ *
+ * The caller may store any non-NULL value through *pslot.  The slot is only
+ * valid until the next insertion, deletion or clear on the dict.
+ * Returns -1 if an error occurred, or 0 on success.  If only the resize
+ * after an insertion failed, -1 is returned but the insertion stands:
+ * *pinserted is 1 and *pslot points at the key's slot in the old table.
+ */
+int
+Dict_GetOrInsert(DictObject *op, void *key, void *dflt,
+                 void ***pslot, int *pinserted)
+{
+    long hash;
+    assert(op->ma_hash);
+
+    hash = op->ma_hash(key);
+    if (hash == -1)
+        return -1;
+    return Dict_GetOrInsertKnownHash(op, key, hash, dflt, pslot, pinserted);
+}
+
+int
+Dict_GetOrInsertKnownHash(DictObject *op, void *key, long hash, void *dflt,
+                          void ***pslot, int *pinserted)
+{
+    register DictEntry *ep;
+    assert(key);
+    assert(dflt);
+    assert(pslot);
+    assert(hash != -1);
+
+    ep = (op->ma_lookup)(op, key, hash);
+    if (ep == NULL)
+        return -1;
+    if (ep->me_value != NULL) {
+        *pslot = &ep->me_value;
+        if (pinserted)
+            *pinserted = 0;
+        return 0;
+    }
+    ep = insertdict_at(op, ep, key, hash, dflt);
+    if (pinserted)
+        *pinserted = 1;
+    /* A failed dictresize() leaves the old table, and so ep, untouched. */
+    *pslot = &ep->me_value;
+    if (DICT_NEEDS_RESIZE(op)) {
+        if (DICT_GROW(op) == -1)
+            return -1;
+        /* The entry moved; find it in the new table. */
+        ep = (op->ma_lookup)(op, key, hash);
+        assert(ep != NULL && ep->me_value == dflt);
+        *pslot = &ep->me_value;
+    }
+    return 0;
+}
+
+/*
+ * Read-modify-write `key` with a single probe.  fn is called with the key,
+ * the current value (NULL if the key is absent) and ctx, and returns the
+ * value to store.  If fn returns NULL the dict is left unchanged and 1 is
+ * returned.  fn must not mutate the dict.
+ * Returns -1 if an error occurred, 1 if fn declined the update, or 0 on
+ * success.  As with Dict_SetItem(), -1 from the resize after an insertion
+ * means the new key is nevertheless in the dict.
+ */
+int
+Dict_Upsert(DictObject *op, void *key,
+            void *(*fn)(void *key, void *value, void *ctx), void *ctx)
+{
+    long hash;
+    register DictEntry *ep;
+    void *value;
+    assert(key);
+    assert(fn);
+    assert(op->ma_hash);
+
+    hash = op->ma_hash(key);
+    if (hash == -1)
+        return -1;
+    ep = (op->ma_lookup)(op, key, hash);
+    if (ep == NULL)
+        return -1;
+    value = fn(key, ep->me_value, ctx);
+    if (value == NULL)
+        return 1;
+    if (ep->me_value != NULL) {
+        ep->me_value = value;
+        return 0;
+    }
+    insertdict_at(op, ep, key, hash, value);
+    if (!DICT_NEEDS_RESIZE(op))
+        return 0;
+    return DICT_GROW(op);
 }
 
 int
@@ -476,6 +958,17 @@ Dict_DelItem(DictObject *op, void *key)
     if (ep->me_value == NULL) {
         return -1;
     }
+    if (op->ma_fcache != NULL) {
+        DictCacheEntry *ce = DICT_FCACHE_SLOT(op, key);
+        if (ce->fc_key == key) {
+            ce->fc_key = NULL;
+            ce->fc_entry = NULL;
+        }
+    }
+    if (DICT_IS_ROBINHOOD(op)) {
+        deldict_robinhood(op, ep);
+        return 0;
+    }
     ep->me_key = dummy;
     ep->me_value = NULL;
     op->ma_used--;
@@ -487,12 +980,14 @@ Dict_Clear(DictObject *op)
 {
     DictEntry *ep, *table;
     int table_is_malloced;
+    size_t mapped;
     ssize_t fill;
     DictEntry small_copy[Dict_MINSIZE];
 
     table = op->ma_table;
     assert(table != NULL);
     table_is_malloced = table != op->ma_smalltable;
+    mapped = op->ma_mapped;
 
     /* This is delicate.  During the process of clearing the dict,
      * decrefs can cause the dict to mutate.  To avoid fatal confusion
@@ -501,6 +996,7 @@ Dict_Clear(DictObject *op)
      * clearing.
      */
     fill = op->ma_fill;
+    DICT_FCACHE_FLUSH(op);
     if (table_is_malloced)
         EMPTY_TO_MINSIZE(op);
 
@@ -515,7 +1011,93 @@ Dict_Clear(DictObject *op)
     }
     /* else it's a small table that's already empty */
     if (table_is_malloced)
-        free(table);
+        dict_table_free(table, mapped);
+}
+
+/*
+ * Set the NUMA placement of the dict's mmap'ed tables: DICT_NUMA_BIND keeps
+ * them on the nodes in `nodemask` (bit n == node n), DICT_NUMA_INTERLEAVE
+ * spreads their pages round-robin over those nodes.  Only tables allocated
+ * afterwards (on the next resize) are affected.
+ * Returns -1 if the mode is invalid or unsupported on this platform.
+ */
+int
+Dict_SetNumaPolicy(DictObject *op, int mode, unsigned long nodemask)
+{
+    if (mode != DICT_NUMA_DEFAULT && mode != DICT_NUMA_BIND &&
+        mode != DICT_NUMA_INTERLEAVE)
+        return -1;
+#if !defined(DICT_HAVE_MMAP) || !defined(SYS_mbind)
+    if (mode != DICT_NUMA_DEFAULT)
+        return -1;
+#endif
+    if (mode != DICT_NUMA_DEFAULT && nodemask == 0)
+        return -1;
+    op->ma_numa_mode = mode;
+    op->ma_numa_nodemask = nodemask;
+    return 0;
+}
+
+/*
+ * Put a front cache of `nslots` slots (a power of 2) in front of the dict's
+ * getitem functions, for workloads where a few keys take most lookups.  A
+ * hit costs one pointer compare and no call to ma_hash or ma_lookup.
+ * nslots == 0 removes the cache.  The hit/miss counters are reset.
+ * Returns -1 if nslots is not a power of 2 or memory is exhausted.
+ */
+int
+Dict_EnableFrontCache(DictObject *op, size_t nslots)
+{
+    DictCacheEntry *cache = NULL;
+
+    if (nslots & (nslots - 1))
+        return -1;
+    if (nslots != 0) {
+        cache = (DictCacheEntry*) calloc(nslots, sizeof(DictCacheEntry));
+        if (cache == NULL) {
+            fprintf(stderr, "no enough memory");
+            return -1;
+        }
+    }
+    free(op->ma_fcache);
+    op->ma_fcache = cache;
+    op->ma_fcache_mask = nslots ? nslots - 1 : 0;
+    op->ma_fcache_hits = op->ma_fcache_misses = 0;
+    return 0;
+}
+
+void
+Dict_GetFrontCacheStats(DictObject *op, unsigned long *phits,
+                        unsigned long *pmisses)
+{
+    if (phits)
+        *phits = op->ma_fcache_hits;
+    if (pmisses)
+        *pmisses = op->ma_fcache_misses;
+}
+
+/*
+ * Select the table engine: DICT_ENGINE_DEFAULT is the CPython-style
+ * perturbed probing with dummy entries, DICT_ENGINE_ROBINHOOD is Robin Hood
+ * linear probing with backward-shift deletion, which suits workloads with
+ * heavy delete/reinsert churn and runs at up to 90% load.
+ * Returns -1 if the mode is invalid or the dict is not empty.
+ */
+int
+Dict_SetEngine(DictObject *op, int engine)
+{
+    if (op->ma_fill != 0)
+        return -1;
+    switch (engine) {
+    case DICT_ENGINE_DEFAULT:
+        op->ma_lookup = lookdict;
+        return 0;
+    case DICT_ENGINE_ROBINHOOD:
+        op->ma_lookup = lookdict_robinhood;
+        return 0;
+    default:
+        return -1;
+    }
 }
 
 /*
@@ -617,6 +1199,7 @@ _DictDebug_Dealloc(DictObject* dict)
         np->next->prev = np->prev;
     }
     free(np);
+    free(dict->ma_fcache);
     free(dict);
     return 0;
 }
@@ -628,6 +1211,7 @@ _Dict_Dealloc(DictObject* dict)
     if (dict == NULL)
         return 0;
     Dict_Clear(dict);
+    free(dict->ma_fcache);
     free(dict);
     return 0;
 }
@@ -646,12 +1230,30 @@ int_hash(void *v)
     return x;
 }
 
+static void *
+upsert_decline(void *key, void *value, void *ctx)
+{
+    (void)key;
+    (void)value;
+    (void)ctx;
+    return NULL;
+}
+
+/* Counts up from the key itself; looks at another key first. */
+static void *
+upsert_peek(void *key, void *value, void *ctx)
+{
+    Dict_GetItem((DictObject*)ctx, (void*)7);
+    return value ? (void*)((ssize_t)value + 1) : key;
+}
+
 void
 dict_test()
 {
     DictObject* dict;
     DictObjNode* node;
     void *key, *value;
+    unsigned long hits, misses;
     ssize_t i;
 
     dict = Dict_New(int_hash);
@@ -672,6 +1274,158 @@ dict_test()
     Dict_DelItem(dict, (void*)1);
     value = Dict_GetItem(dict, (void*)1);
     assert(!value);
+
+    for (i = 1; i != 100; ++i) {
+        void **slot;
+        int inserted;
+        Dict_GetOrInsert(dict, (void*)(i % 20 + 1), (void*)1, &slot, &inserted);
+        if (!inserted)
+            *slot = (void*)((ssize_t)*slot + 1);
+    }
+    assert(Dict_GetItem(dict, (void*)20) == (void*)5);
+    assert(Dict_Upsert(dict, (void*)50, upsert_decline, NULL) == 1);
+    assert(Dict_GetItem(dict, (void*)50) == NULL);
+    assert(Dict_Upsert(dict, (void*)50, upsert_peek, dict) == 0);
+    assert(Dict_GetItem(dict, (void*)50) == (void*)50);
+    assert(Dict_Upsert(dict, (void*)50, upsert_peek, dict) == 0);
+    assert(Dict_GetItem(dict, (void*)50) == (void*)51);
+
+    assert(Dict_SetItemKnownHash(dict, (void*)60, int_hash((void*)60),
+                                 (void*)6) == 0);
+    assert(Dict_GetItemKnownHash(dict, (void*)60, int_hash((void*)60))
+           == (void*)6);
+    assert(Dict_GetItem(dict, (void*)60) == (void*)6);
+    assert(Dict_GetItemKnownHash(dict, (void*)61, int_hash((void*)61))
+           == NULL);
+    {
+        void **slot;
+        int inserted;
+        assert(Dict_GetOrInsertKnownHash(dict, (void*)61, int_hash((void*)61),
+                                         (void*)1, &slot, &inserted) == 0);
+        assert(inserted == 1 && *slot == (void*)1);
+        *slot = (void*)2;
+        assert(Dict_GetOrInsertKnownHash(dict, (void*)61, int_hash((void*)61),
+                                         (void*)1, &slot, &inserted) == 0);
+        assert(inserted == 0 && *slot == (void*)2);
+        assert(Dict_GetItem(dict, (void*)61) == (void*)2);
+    }
+    Dict_Dealloc(dict);
+
+    dict = Dict_New(int_hash);
+    Dict_EnableFrontCache(dict, 16);
+    Dict_SetItem(dict, (void*)1, (void*)1);
+    assert(Dict_GetItem(dict, (void*)1) == (void*)1);   /* miss, cached */
+    assert(Dict_GetItem(dict, (void*)1) == (void*)1);   /* hit */
+    Dict_GetFrontCacheStats(dict, &hits, &misses);
+    assert(hits == 1 && misses == 1);
+    Dict_DelItem(dict, (void*)1);
+    assert(Dict_GetItem(dict, (void*)1) == NULL);
+    assert(Dict_GetItem(dict, NULL) == NULL);           /* bypasses cache */
+    Dict_GetFrontCacheStats(dict, &hits, &misses);
+    assert(hits == 1 && misses == 2);
+    Dict_SetItem(dict, (void*)2, (void*)2);
+    Dict_GetItem(dict, (void*)2);
+    for (i = 3; i != 100; ++i)                           /* resizes */
+        Dict_SetItem(dict, (void*)i, (void*)i);
+    assert(Dict_GetItem(dict, (void*)2) == (void*)2);   /* flushed: miss */
+    assert(Dict_GetItem(dict, (void*)2) == (void*)2);   /* hit */
+    Dict_GetFrontCacheStats(dict, &hits, &misses);
+    assert(hits == 2 && misses == 4);
+    Dict_Clear(dict);
+    assert(Dict_GetItem(dict, (void*)2) == NULL);
+    assert(Dict_GetItem(dict, NULL) == NULL);
+    assert(Dict_GetItemKnownHash(dict, NULL, 0) == NULL);
+    Dict_GetFrontCacheStats(dict, &hits, &misses);
+    assert(hits == 2 && misses == 5);
+    Dict_Dealloc(dict);
+
+    dict = Dict_New(int_hash);
+    Dict_SetEngine(dict, DICT_ENGINE_ROBINHOOD);
+    for (i = 1; i != 1000; ++i) {
+        Dict_SetItem(dict, (void*)i, (void*)i);
+        if (i % 3 == 0)
+            Dict_DelItem(dict, (void*)(i / 3));
+    }
+    for (i = 1; i != 1000; ++i) {
+        value = Dict_GetItem(dict, (void*)i);
+        assert((ssize_t)value == (i <= 333 ? 0 : i));
+    }
+    assert(dict->ma_fill == dict->ma_used);
+    Dict_Dealloc(dict);
+
+    /* A small Robin Hood table grows before its last Unused slot is used. */
+    dict = Dict_New(int_hash);
+    Dict_SetEngine(dict, DICT_ENGINE_ROBINHOOD);
+    for (i = 1; i != 7; ++i)
+        Dict_SetItem(dict, (void*)i, (void*)i);
+    assert(dict->ma_mask == Dict_MINSIZE - 1);
+    Dict_SetItem(dict, (void*)7, (void*)7);
+    assert(dict->ma_mask > Dict_MINSIZE - 1);
+    for (i = 8; i != 1000; ++i) {
+        Dict_SetItem(dict, (void*)i, (void*)i);
+        assert(dict->ma_fill < dict->ma_mask);
+    }
+    Dict_Dealloc(dict);
+
+    /* Upsert/GetOrInsert on a Robin Hood dict; the callback reads the dict
+       between the lookup and the insertion. */
+    dict = Dict_New(int_hash);
+    Dict_SetEngine(dict, DICT_ENGINE_ROBINHOOD);
+    for (i = 8; i <= 40; i += 8)
+        Dict_SetItem(dict, (void*)i, (void*)i);
+    assert(Dict_Upsert(dict, (void*)3, upsert_peek, dict) == 0);
+    assert(Dict_GetItem(dict, (void*)3) == (void*)3);
+    assert(Dict_Upsert(dict, (void*)3, upsert_peek, dict) == 0);
+    assert(Dict_GetItem(dict, (void*)3) == (void*)4);
+    for (i = 1; i != 200; ++i) {
+        void **slot;
+        int inserted;
+        Dict_GetOrInsert(dict, (void*)(i % 50 + 1), (void*)1, &slot, &inserted);
+        if (!inserted)
+            *slot = (void*)((ssize_t)*slot + 1);
+    }
+    assert(Dict_GetItem(dict, (void*)50) == (void*)4);
+    for (i = 8; i <= 40; i += 8)
+        assert(Dict_GetItem(dict, (void*)i) == (void*)(i + 4));
+    Dict_Dealloc(dict);
+
+    /* Large tables: mmap'ed on the way up, back to malloc on the way down. */
+    dict = Dict_New(int_hash);
+    assert(Dict_SetNumaPolicy(dict, 42, 1) == -1);
+    assert(Dict_SetNumaPolicy(dict, DICT_NUMA_BIND, 0) == -1);
+    assert(Dict_SetNumaPolicy(dict, DICT_NUMA_DEFAULT, 0) == 0);
+#if defined(DICT_HAVE_MMAP) && defined(SYS_mbind)
+    assert(Dict_SetNumaPolicy(dict, DICT_NUMA_INTERLEAVE, 1) == 0);
+#endif
+    for (i = 1; i <= 100000; ++i)
+        Dict_SetItem(dict, (void*)i, (void*)i);
+#ifdef DICT_HAVE_MMAP
+    assert(dict->ma_mapped != 0);
+#endif
+    for (i = 1; i <= 100000; ++i)
+        assert(Dict_GetItem(dict, (void*)i) == (void*)i);
+    for (i = 100; i <= 100000; ++i)
+        Dict_DelItem(dict, (void*)i);
+    /* Churn until the resize that purges the dummies and shrinks. */
+    for (i = 100001; ; ++i) {
+        Dict_SetItem(dict, (void*)i, (void*)i);
+        if (dict->ma_fill == dict->ma_used)
+            break;
+        Dict_DelItem(dict, (void*)i);
+    }
+    assert(dict->ma_mapped == 0 && DICT_GET_SIZE(dict) == 100);
+    assert(Dict_GetItem(dict, (void*)i) == (void*)i);
+    for (key = (void*)1; (ssize_t)key <= 100000;
+         key = (void*)((ssize_t)key + 1))
+        assert(Dict_GetItem(dict, key) == ((ssize_t)key < 100 ? key : NULL));
+    Dict_Clear(dict);
+    assert(dict->ma_mapped == 0 && DICT_GET_SIZE(dict) == 0);
+    for (i = 1; i <= 100000; ++i)
+        Dict_SetItem(dict, (void*)i, (void*)(i + 1));
+    Dict_Clear(dict);                                  /* mmap'ed table */
+    assert(dict->ma_mapped == 0 && Dict_GetItem(dict, (void*)1) == NULL);
+    Dict_SetItem(dict, (void*)1, (void*)1);
+    assert(Dict_GetItem(dict, (void*)1) == (void*)1);
     Dict_Dealloc(dict);
 
     if (obj_list != NULL) {
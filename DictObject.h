@@ -47,10 +47,36 @@ int _Dict_Dealloc(DictObject*);
 
 void * Dict_GetItem(DictObject *mp, void *key);
 int Dict_SetItem(DictObject *mp, void *key, void *item);
+void * Dict_GetItemKnownHash(DictObject *mp, void *key, long hash);
+int Dict_SetItemKnownHash(DictObject *mp, void *key, long hash, void *item);
+int Dict_GetOrInsert(DictObject *mp, void *key, void *dflt,
+                     void ***pslot, int *pinserted);
+int Dict_GetOrInsertKnownHash(DictObject *mp, void *key, long hash, void *dflt,
+                              void ***pslot, int *pinserted);
+int Dict_Upsert(DictObject *mp, void *key,
+                void *(*fn)(void *key, void *value, void *ctx), void *ctx);
 int Dict_DelItem(DictObject *mp, void *key);
 void Dict_Clear(void *mp);
 int Dict_Next(DictObject *mp, ssize_t *pos, void **key, void **value);
 
+/* NUMA placement of large (mmap'ed) tables */
+#define DICT_NUMA_DEFAULT    0
+#define DICT_NUMA_BIND       1
+#define DICT_NUMA_INTERLEAVE 2
+
+int Dict_SetNumaPolicy(DictObject *mp, int mode, unsigned long nodemask);
+
+/* Table engines */
+#define DICT_ENGINE_DEFAULT   0
+#define DICT_ENGINE_ROBINHOOD 1
+
+int Dict_SetEngine(DictObject *mp, int engine);
+
+/* Front cache for skewed lookup workloads */
+int Dict_EnableFrontCache(DictObject *mp, size_t nslots);
+void Dict_GetFrontCacheStats(DictObject *mp, unsigned long *hits,
+                             unsigned long *misses);
+
 #define DICT_GET_SIZE(op) (((DictObject *)(op))->ma_used)
 
 /* hash function */